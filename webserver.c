@@ -1,6 +1,7 @@
 #include <stdio.h>               // Biblioteca padrão para entrada e saída
 #include <string.h>              // Biblioteca manipular strings
 #include <stdlib.h>              // funções para realizar várias operações, incluindo alocação de memória dinâmica (malloc)
+#include <strings.h>             // strncasecmp para comparar nomes de cabeçalhos http
 
 #include "pico/stdlib.h"         // Biblioteca da Raspberry Pi Pico para funções padrão (GPIO, temporização, etc.)
 #include "hardware/adc.h"        // Biblioteca da Raspberry Pi Pico para manipulação do conversor ADC
@@ -8,6 +9,7 @@
 #include "hardware/pwm.h"
 #include "hardware/clocks.h"
 #include "hardware/pio.h"
+#include "hardware/sync.h"       // Barreiras de memória e bloqueio de interrupções para o seqlock
 #include "RVpio.pio.h"
 
 #include "lwip/pbuf.h"           // Lightweight IP stack - manipulação de buffers de pacotes de rede
@@ -15,6 +17,7 @@
 #include "lwip/netif.h"          // Lightweight IP stack - fornece funções e estruturas para trabalhar com interfaces de rede (netif)
 
 #include "pico/bootrom.h"
+#include "pico/rand.h"           // Número aleatório para identificar o boot nas etags
 
 // Credenciais WIFI - Tome cuidado se publicar no github!
 #define WIFI_SSID "SSID"
@@ -33,6 +36,10 @@
 #define BUZZER_A 10 // BUZZER A
 #define BUZZER_B 21 // BUZZER B
 
+#define SENSOR_SAMPLE_MS 500 // intervalo de amostragem dos sensores pelo timer
+#define SENSOR_DEADBAND 1    // variação mínima (exclusiva) para publicar uma nova leitura
+#define HTML_BODY_SIZE 3072  // tamanho do buffer do corpo html em cache
+
 
 //struct para armazenar a pio
 typedef struct pio_refs{
@@ -55,8 +62,39 @@ typedef struct drawing {
     rgb main_color;  /**< Cor principal da figura. */
 } sketch;
 
+//struct para armazenar o estado do dispositivo
+typedef struct device_states {
+    int light_level;    /**< Intensidade da luminária: 0 desligada, 1 baixa, 2 média, 3 alta. */
+    bool water;         /**< Acionamento de água ligado. */
+    float temperature;  /**< Última leitura de temperatura (joystick). */
+    int humidity;       /**< Última leitura de umidade (joystick). */
+    uint32_t version;   /**< Incrementada a cada mudança do estado. */
+} device_state;
+
+//struct para armazenar o corpo html já renderizado
+typedef struct html_caches {
+    char body[HTML_BODY_SIZE];
+    size_t length;
+    uint32_t version;
+    bool valid;
+} html_cache;
+
 //definição de pio estática para manipulação facilitada através das requisições
 static pio_ref my_pio;
+
+//estado do dispositivo publicado por seqlock: número de sequência ímpar indica escrita em andamento
+static device_state dev_state;
+static volatile uint32_t dev_state_seq = 0;
+
+//cache da resposta html, acessado apenas pelo callback do tcp
+static html_cache page_cache;
+
+//timer de amostragem dos sensores
+static repeating_timer_t sensor_timer;
+
+//identificador do boot, para que as etags não se repitam após reiniciar (a versão recomeça do zero)
+static uint32_t boot_id;
+
 // Inicia PWM para os pinos dos LEDs e Buzzer 
 void led_pwm(void);
 void buzzer_pwm(void);
@@ -72,6 +110,19 @@ static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
 // Leitura da temperatura interna
 float temp_read(void);
 
+// Leitura e escrita do estado do dispositivo
+void device_state_read(device_state *out);
+void device_state_set_light(int level);
+void device_state_set_water(bool water);
+void device_state_set_sensors(float temperature, int humidity);
+
+// Amostragem periódica dos sensores
+bool sensor_timer_callback(repeating_timer_t *rt);
+void sensor_sample(void);
+
+// Renderiza o corpo html a partir de um estado
+size_t render_page(const device_state *state, char *buffer, size_t size);
+
 // Tratamento do request do usuário
 int user_request(char **request);
 
@@ -183,6 +234,13 @@ int main()
     adc_init();
     adc_set_temp_sensor_enabled(true);
 
+    // Identificador deste boot para as etags
+    boot_id = get_rand_32();
+
+    // Primeira leitura dos sensores e amostragem periódica pelo timer
+    sensor_sample();
+    add_repeating_timer_ms(-SENSOR_SAMPLE_MS, sensor_timer_callback, NULL, &sensor_timer);
+
     while (true)
     {
         /* 
@@ -280,6 +338,7 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        device_state_set_light(3);
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     } else if (strstr(aux, "GET /led_m") != NULL) // acende a luminária na intensidade média
     {
@@ -296,6 +355,7 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        device_state_set_light(2);
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     } else if (strstr(aux, "GET /led_l") != NULL) //acende a luminária na baixa intensidade
     {
@@ -312,6 +372,7 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        device_state_set_light(1);
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     } else if (strstr(aux, "GET /led_o") != NULL) //desliga a luminária
     {
@@ -328,6 +389,7 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        device_state_set_light(0);
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     }
     if (strstr(aux, "GET /buzzer") != NULL) //liga o buzzer
@@ -353,6 +415,8 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        //a água assume a matriz de leds, então a luminária fica desligada
+        device_state_set_light(0);
         pwm_level = 1;
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     } else if (strstr(aux, "GET /water_o") != NULL) //desliga o acionamento de água
@@ -370,6 +434,8 @@ int user_request(char **request){
             } 
         };
         draw(sketch, 0, my_pio, 25);
+        //a água assume a matriz de leds, então a luminária fica desligada
+        device_state_set_light(0);
         pwm_level = -1;
         //printf("\n\n\nMATRIZ: %d\n\n\n", level);
     }
@@ -387,38 +453,96 @@ float temp_read(void){
 }
 
 
-static int current_pwm_level = 0;
-static int lastLevel = 0;
-// Função de callback para processar requisições HTTP
-static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
-{
-    if (!p)
-    {
-        tcp_close(tpcb);
-        tcp_recv(tpcb, NULL);
-        return ERR_OK;
+// Leitura e escrita do estado do dispositivo - seqlock
+// Os escritores (callback do tcp e timer) desativam interrupções para não se sobreporem;
+// os leitores nunca bloqueiam, apenas repetem a cópia se uma escrita ocorreu no meio.
+void device_state_read(device_state *out){
+    uint32_t seq;
+    do {
+        seq = dev_state_seq;
+        while (seq & 1u){
+            tight_loop_contents();
+            seq = dev_state_seq;
+        }
+        __dmb();
+        *out = dev_state;
+        __dmb();
+    } while (seq != dev_state_seq);
+}
+
+static inline void device_state_write_begin(void){
+    dev_state_seq++;
+    __dmb();
+}
+
+static inline void device_state_write_end(void){
+    dev_state.version++;
+    __dmb();
+    dev_state_seq++;
+}
+
+void device_state_set_light(int level){
+    uint32_t irq = save_and_disable_interrupts();
+    if (dev_state.light_level != level){
+        device_state_write_begin();
+        dev_state.light_level = level;
+        device_state_write_end();
     }
+    restore_interrupts(irq);
+}
 
-    // Alocação do request na memória dinámica
-    char *request = (char *)malloc(p->len + 1);
-    memcpy(request, p->payload, p->len);
-    request[p->len] = '\0';
+void device_state_set_water(bool water){
+    uint32_t irq = save_and_disable_interrupts();
+    if (dev_state.water != water){
+        device_state_write_begin();
+        dev_state.water = water;
+        device_state_write_end();
+    }
+    restore_interrupts(irq);
+}
 
-    printf("Request: %s\n", request);
+void device_state_set_sensors(float temperature, int humidity){
+    uint32_t irq = save_and_disable_interrupts();
+    if (dev_state.temperature != temperature || dev_state.humidity != humidity){
+        device_state_write_begin();
+        dev_state.temperature = temperature;
+        dev_state.humidity = humidity;
+        device_state_write_end();
+    }
+    restore_interrupts(irq);
+}
 
-    // Tratamento de request - Controle dos LEDs
-    
-    int level = user_request(&request);
-    if (level != 0)
-        lastLevel = level;
+// Leitura dos sensores (joystick) - só altera a versão se alguma leitura se afastar
+// mais que SENSOR_DEADBAND do valor publicado, evitando que o ruído do ADC invalide o cache
+void sensor_sample(void){
+    static bool published = false;
 
-    // Leitura da temperatura interna
-    //float temperature = temp_read();
-    adc_select_input(1); // GPIO 26 = ADC0
+    adc_select_input(1); // GPIO 27 = ADC1
     float temperature = (adc_read() * 50) / 4095;
     adc_select_input(0); // GPIO 26 = ADC0
     int humidity = (adc_read() * 100) / 4095;
-    if (lastLevel > 0){
+
+    device_state state;
+    device_state_read(&state);
+    if (published
+        && abs((int)temperature - (int)state.temperature) <= SENSOR_DEADBAND
+        && abs(humidity - state.humidity) <= SENSOR_DEADBAND)
+        return;
+
+    device_state_set_sensors(temperature, humidity);
+    published = true;
+}
+
+bool sensor_timer_callback(repeating_timer_t *rt){
+    sensor_sample();
+    return true;
+}
+
+// Renderiza o corpo html a partir de um estado
+size_t render_page(const device_state *state, char *buffer, size_t size){
+    float temperature = state->temperature;
+    int humidity = state->humidity;
+    if (state->water){
         humidity += 5;
         temperature -=1;
     }
@@ -430,15 +554,12 @@ static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
     else 
         sprintf(condition, "ruins!");
 
-    // Cria a resposta HTML
-    char html[3072];
+    //intensidade da luminária exibida na página
+    static const char *light_names[] = {"desligada", "baixa", "média", "alta"};
+    const char *light = (state->light_level >= 0 && state->light_level <= 3) ? light_names[state->light_level] : "desconhecida";
 
     // Instruções html do webserver
-    snprintf(html, sizeof(html), // Formatar uma string e armazená-la em um buffer de caracteres
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/html\r\n"
-            "Connection: close\r\n"
-            "\r\n"
+    int length = snprintf(buffer, size, // Formatar uma string e armazená-la em um buffer de caracteres
             "<!DOCTYPE html>"
             "<html>"
                 "<head>"
@@ -546,6 +667,7 @@ static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
                                     "<form action=\"./led_o\" method=\"GET\" class=\"form-group\">"
                                         "<button type=\"submit\" class=\"btn btn-d\">Off</button>"
                                     "</form>"
+                                    "<p class=\"text\">Intensidade: %s</p>"
                                 "</div>"
                             "</div>"
                             "<div class=\"card\">"
@@ -580,10 +702,131 @@ static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
                         "</div>"
                     "</div>"
                 "</body>"
-            "</html>", temperature, humidity, condition);
+            "</html>", light, temperature, humidity, condition);
+
+    if (length < 0)
+        return 0;
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+// Verifica se o cabeçalho If-None-Match do request contém a etag atual
+// O nome do cabeçalho é comparado sem diferenciar maiúsculas; o valor pode ser "*" ou uma lista separada por vírgulas
+static bool etag_matches(const char *request, const char *etag){
+    static const char name[] = "If-None-Match:";
+    const size_t name_len = sizeof(name) - 1;
+    const size_t etag_len = strlen(etag);
+
+    //procura o cabeçalho linha a linha, pulando a linha do request
+    const char *line = strstr(request, "\r\n");
+    while (line != NULL){
+        line += 2;
+        if (line[0] == '\r' || line[0] == '\0') //fim dos cabeçalhos
+            return false;
+        if (strncasecmp(line, name, name_len) == 0)
+            break;
+        line = strstr(line, "\r\n");
+    }
+    if (line == NULL)
+        return false;
+
+    const char *value = line + name_len;
+    const char *line_end = strstr(value, "\r\n");
+    if (line_end == NULL)
+        line_end = value + strlen(value);
+
+    //percorre cada etag da lista
+    while (value < line_end){
+        while (value < line_end && (*value == ' ' || *value == '\t' || *value == ','))
+            value++;
+        const char *end = value;
+        while (end < line_end && *end != ',')
+            end++;
+        const char *tag_end = end;
+        while (tag_end > value && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            tag_end--;
+
+        size_t tag_len = tag_end - value;
+        if (tag_len == 1 && value[0] == '*')
+            return true;
+        //If-None-Match usa comparação fraca: ignora o prefixo W/
+        if (tag_len > 2 && value[0] == 'W' && value[1] == '/'){
+            value += 2;
+            tag_len -= 2;
+        }
+        if (tag_len == etag_len && memcmp(value, etag, etag_len) == 0)
+            return true;
+
+        value = end;
+    }
+    return false;
+}
+
+// Função de callback para processar requisições HTTP
+static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
+{
+    if (!p)
+    {
+        tcp_close(tpcb);
+        tcp_recv(tpcb, NULL);
+        return ERR_OK;
+    }
+
+    // Alocação do request na memória dinámica
+    char *request = (char *)malloc(p->len + 1);
+    memcpy(request, p->payload, p->len);
+    request[p->len] = '\0';
+
+    printf("Request: %s\n", request);
+
+    // Tratamento de request - Controle dos LEDs
+    
+    int level = user_request(&request);
+    if (level != 0)
+        device_state_set_water(level > 0);
+
+    // Cópia consistente do estado atual
+    device_state state;
+    device_state_read(&state);
+
+    char etag[24];
+    snprintf(etag, sizeof(etag), "\"%08lx-%lu\"", (unsigned long)boot_id, (unsigned long)state.version);
 
-    // Escreve dados para envio (mas não os envia imediatamente).
-    tcp_write(tpcb, html, strlen(html), TCP_WRITE_FLAG_COPY);
+    char header[160];
+
+    if (etag_matches(request, etag))
+    {
+        // O cliente já possui esta versão da página
+        snprintf(header, sizeof(header),
+                "HTTP/1.1 304 Not Modified\r\n"
+                "ETag: %s\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Connection: close\r\n"
+                "\r\n", etag);
+        tcp_write(tpcb, header, strlen(header), TCP_WRITE_FLAG_COPY);
+    }
+    else
+    {
+        // Renderiza novamente apenas se o estado mudou desde a última resposta
+        if (!page_cache.valid || page_cache.version != state.version)
+        {
+            page_cache.length = render_page(&state, page_cache.body, sizeof(page_cache.body));
+            page_cache.version = state.version;
+            page_cache.valid = true;
+        }
+
+        snprintf(header, sizeof(header),
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/html\r\n"
+                "Content-Length: %u\r\n"
+                "ETag: %s\r\n"
+                "Cache-Control: no-cache\r\n"
+                "Connection: close\r\n"
+                "\r\n", (unsigned)page_cache.length, etag);
+
+        // Escreve dados para envio (mas não os envia imediatamente).
+        tcp_write(tpcb, header, strlen(header), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+        tcp_write(tpcb, page_cache.body, page_cache.length, TCP_WRITE_FLAG_COPY);
+    }
 
     // Envia a mensagem
     tcp_output(tpcb);